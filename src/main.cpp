@@ -1,20 +1,29 @@
-#include <FS.h>
 #include <WiFi.h>
 #include <WiFiManager.h>
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
-#include <SPIFFS.h>
+#include <AsyncJson.h>
 #include <ArduinoJson.h>
 #include "SimpleFSM.h"
 #include <Bounce2.h>
 #include "driver/ledc.h"
 #include "driver/pcnt.h"
+#include "driver/gpio.h"
 #include "soc/pcnt_struct.h"
 #include <NMEA2000_esp32.h>
 #include <N2kMessages.h>
 #include <N2kMsg.h>
-
-#define JSON_CONFIG_FILE "/config.json"
+#include <PubSubClient.h>
+#include <Preferences.h>
+#include "rom/crc.h"
+#include "nvs.h"
+#include <algorithm>
+
+// Binary config store in NVS
+#define CONFIG_NAMESPACE "winchcfg"
+#define CONFIG_KEY "config"
+#define CONFIG_VERSION 1
+#define CONFIG_MAX_SIZE 256   // largest blob accepted from NVS
 
 // --------------- BUTTON INSTANCES ----------------
 Bounce2::Button buttonDown = Bounce2::Button();
@@ -35,9 +44,22 @@ Bounce2::Button radioButtonUp   = Bounce2::Button();
 #define MAX_FREQ 4000
 #define PWM_RESOLUTION 8 // bits
 #define PWM_CHANNEL 0
+#define RAMP_STEP_MS 20  // ms between frequency steps while ramping up
 
 // Speed pulse counting pin
 #define PCNT_PIN 25
+#define PULSES_PER_REVOLUTION 1   // sensor pulses per winch drum revolution
+#define RPM_WINDOW 1000           // ms over which rpm is averaged
+#define RODE_PCNT_UNIT PCNT_UNIT_0
+#define RODE_PULSES_PER_METRE 10.0
+
+// Rode counter / runtime statistics log in NVS
+#define RODE_LOG_NAMESPACE "rodelog"
+#define RODE_LOG_SLOTS 16                // records in the circular log
+#define RODE_LOG_MIN_INTERVAL 2000       // ms, rate limit between writes
+#define RODE_LOG_MOVING_INTERVAL 30000   // ms, checkpoint while the motor runs
+#define RODE_LOG_SETTLE_TIME 3000        // ms without pulses before a stopped chain is written
+#define RODE_COAST_TIME 1000             // ms after a haul-in stop still counted as hauling in
 
 // CAN bus pins
 #define CAN_RX_PIN GPIO_NUM_34
@@ -49,6 +71,24 @@ Bounce2::Button radioButtonUp   = Bounce2::Button();
 #define SwitchBankInstance 0x04
 #define NumberOfSwitches 8
 
+// MQTT telemetry & command bridge
+#define MQTT_DEFAULT_PORT 1883
+#define MQTT_DEFAULT_INTERVAL 250      // ms between batched telemetry publishes
+#define MQTT_RECONNECT_INTERVAL 5000   // ms between broker connection attempts
+#define MQTT_SOCKET_TIMEOUT 2          // s, CONNACK / read timeout (library default 15)
+#define MQTT_KEEPALIVE 5               // s; a dead link is noticed after 1.5-2x this
+#define MQTT_TASK_STACK 6144
+#define MQTT_TASK_PERIOD 10            // ms between MQTT task iterations
+#define MQTT_TOPIC_TELEMETRY "anchorwinch/telemetry"
+#define MQTT_TOPIC_COMMAND   "anchorwinch/cmd"
+#define MQTT_TOPIC_STATUS    "anchorwinch/status"
+#define MQTT_QUEUE_SIZE 16             // payloads kept while the broker is unreachable
+#define MQTT_PAYLOAD_SIZE 128
+#define MQTT_MAX_EVENTS 8              // state changes batched into one payload
+
+// Command-to-output latency measurement
+#define LATENCY_SAMPLES 64   // most recent samples kept per source and kind
+
 // We will send these messages
 const unsigned long TransmitMessages[] PROGMEM = { 127502L, 130813L, 0 };
 
@@ -65,26 +105,68 @@ uint8_t CzMfdDisplaySyncState2 = 0;
 // Global pointer for NMEA2000 object
 tNMEA2000 *nmea2000;
 
-// Pin controlling the 48 V motor power
-int switchPin = 14;
+// --------------- CONFIGURATION ---------------
+// Stored as a binary blob in NVS and copied straight into `config` at boot.
+// Only ever append fields (and bump CONFIG_VERSION): an older blob is a
+// prefix of the current layout, so fields it lacks keep their defaults.
+struct WinchConfig {
+  // pins
+  uint8_t  switchPin;        // 48 V motor power
+  uint8_t  pwmPin;           // winch speed
+  uint8_t  reversePin;       // forward/reverse
+  // PWM limits
+  uint16_t minFreq;
+  uint16_t maxFreq;
+  uint8_t  dutyCycle;        // speed at boot, 0..255
+  // ramp profile
+  uint16_t rampUpMs;         // 0 = full speed immediately
+  // NMEA2000
+  uint8_t  n2kDeviceInstance;
+  uint8_t  n2kSwitchBankInstance;
+  // rode counter calibration
+  float    pulsesPerMetre;
+  // MQTT
+  char     mqttServer[40];   // empty = disabled
+  uint16_t mqttPort;
+  uint16_t mqttInterval;     // ms between batched telemetry publishes
+};
 
-// Winch PWM pin & dutyCycle
-int pwmPin = 33;
-int dutyCycle = 15;  // range 0..255
+struct ConfigHeader {
+  uint16_t version;
+  uint16_t size;             // sizeof(WinchConfig) of the writer
+  uint32_t crc;              // over the config bytes that follow
+};
 
-// Forward/Reverse pin
-int reversePin = 19;
+const WinchConfig defaultConfig = {
+  14, 33, 19,                // switch, PWM, reverse pins
+  MIN_FREQ, MAX_FREQ, 15,
+  0,
+  BinaryDeviceInstance, SwitchBankInstance,
+  RODE_PULSES_PER_METRE,
+  "", MQTT_DEFAULT_PORT, MQTT_DEFAULT_INTERVAL
+};
+
+WinchConfig config = defaultConfig;
+
+// Winch speed, set from the slider at runtime
+int dutyCycle = 15;  // range 0..255
 
-// For measuring speed (unused in detail but left for reference)
+// For measuring speed; rpm is derived from the PCNT counts in handleRodeCounter()
 int InterruptCounter, rpm;
 volatile unsigned long pulseCount = 0;
 
+// Rode paid out in metres
+float chainOut = 0;
+
 // --------------- WEBSOCKET & SERVER ---------------
 AsyncWebServer server(80);
 AsyncWebSocket ws("/ws");  // Declare it BEFORE using it in any function
 
 // --------------- FSM SETUP ---------------
 SimpleFSM fsm;
+// Triggers arrive from the loop, AsyncTCP and MQTT tasks; the mutex also
+// keeps them out while a new config swaps the output pins
+SemaphoreHandle_t fsmMutex = NULL;
 
 // Forward-declare these so the FSM can reference them
 void on_off();
@@ -135,19 +217,22 @@ Transition transitions[] = {
 int num_transitions = sizeof(transitions) / sizeof(Transition);
 
 // ---------------- HELPER FUNCTIONS ----------------
-String getState() {
-  StaticJsonDocument<100> json;
-  // figure out which state index we’re in
-  int wantedpos = 0;
+// figure out which state index we’re in
+int getStateIndex() {
   for (int i = 0; i < (int)(sizeof(s)/sizeof(s[0])); i++) {
     if (fsm.getState() == &s[i]) {
-       wantedpos = i;
-       break;
+       return i;
     }
   }
+  return 0;
+}
+
+String getState() {
+  StaticJsonDocument<100> json;
+  int wantedpos = getStateIndex();
   // Provide some relevant data
   json["controllerState"] = wantedpos;
-  json["chainOut"] = 0; // example placeholder
+  json["chainOut"] = chainOut;
   json["rpm"]     = rpm;
   json["mainSwitch"] = (wantedpos != 0); 
   // If we are in state 0 ("off"), mainSwitch = false; else true
@@ -157,41 +242,731 @@ String getState() {
   return response;
 }
 
+// --------------- COMMAND LATENCY ---------------
+// Time from a command arriving at the firmware until the motor power
+// (switchPin) or N2K relay pin is written. The clock starts where the input
+// first becomes visible to us, so loop stalls before the command is handled
+// are included:
+//   websocket - frame delivered by the AsyncTCP task (onEvent)
+//   mqtt      - message delivered by PubSubClient on the MQTT task
+//   button,   - pin edge, timestamped in a GPIO interrupt (includes the
+//   radio       debounce interval)
+//   n2k       - end of the previous ParseMessages() drain; frames wait in
+//               the driver queue until the next one, so this is an upper bound
+// Samples are split by whether the write cut power ("stop") or applied it
+// ("move"). A stop is only counted when the motor was actually powered.
+// PGN 127502 drives the CZone relay pins, not the motor, so those samples are
+// relay latency and reported as "relayOn"/"relayOff" instead.
+enum latencySource {
+  LATENCY_WEBSOCKET,
+  LATENCY_N2K,
+  LATENCY_BUTTON,
+  LATENCY_RADIO,
+  LATENCY_MQTT,
+  LATENCY_SOURCES
+};
+const char* latencySourceNames[LATENCY_SOURCES] = { "websocket", "n2k", "button", "radio", "mqtt" };
+
+struct LatencyStats {
+  uint32_t samples[LATENCY_SAMPLES]; // us, ring buffer
+  uint8_t  next;
+  uint8_t  count;
+  uint32_t total;
+  uint32_t max;
+};
+// Written from the loop, AsyncTCP and MQTT tasks; guarded by latencyMux
+portMUX_TYPE latencyMux = portMUX_INITIALIZER_UNLOCKED;
+LatencyStats latencyStats[LATENCY_SOURCES][2]; // [source][0 = move, 1 = stop]
+
+// The FSM callbacks run on the task that fired the trigger, so the output
+// stamp is kept per task
+thread_local unsigned long latencyOutputMicros = 0;
+thread_local bool latencyOutputSeen = false;
+thread_local bool latencyStopping = false;
+
+// Pin edges of the local and radio buttons
+struct LatencyEdge {
+  uint8_t pin;
+  volatile unsigned long first;   // us, first edge since the last consumed one
+  volatile unsigned long last;    // us, most recent edge
+  volatile bool pending;
+};
+enum latencyEdgeIndex { EDGE_BUTTON_DOWN, EDGE_BUTTON_UP, EDGE_RADIO_DOWN, EDGE_RADIO_UP, EDGE_COUNT };
+LatencyEdge latencyEdges[EDGE_COUNT] = {
+  { BUTTON_DOWN_PIN }, { BUTTON_UP_PIN }, { RADIO_BUTTON_DOWN_PIN }, { RADIO_BUTTON_UP_PIN }
+};
+
+// End of the last N2K ParseMessages() call, see above
+unsigned long n2kDrainMicros = 0;
+
+void IRAM_ATTR latencyEdgeISR(void *arg) {
+  LatencyEdge *e = (LatencyEdge*)arg;
+  unsigned long now = micros();
+  e->last = now;
+  if (!e->pending) {
+    e->first = now;
+    e->pending = true;
+  }
+}
+
+void initLatencyEdges() {
+  for (uint8_t i = 0; i < EDGE_COUNT; i++) {
+    attachInterruptArg(latencyEdges[i].pin, latencyEdgeISR, &latencyEdges[i], CHANGE);
+  }
+}
+
+// Arrival time of the debounced change Bounce2 just reported for this pin
+unsigned long latencyEdgeArrival(uint8_t edge) {
+  LatencyEdge& e = latencyEdges[edge];
+  unsigned long arrival = e.pending ? e.first : micros();
+  e.pending = false;
+  return arrival;
+}
+
+// Drop edges that never turned into a debounced change (glitches, bounce
+// after a change), so they don't backdate the next press
+void latencyEdgeExpire(uint8_t edge, Bounce2::Button& button) {
+  LatencyEdge& e = latencyEdges[edge];
+  if (e.pending && digitalRead(e.pin) == button.read() &&
+      micros() - e.last > 2000UL * DEBOUNCE_TIME) {
+    e.pending = false;
+  }
+}
+
+void latencyBegin() {
+  latencyOutputSeen = false;
+}
+
+// Called right after the output pin write
+void latencyOutput(bool stopping) {
+  latencyOutputMicros = micros();
+  latencyStopping = stopping;
+  latencyOutputSeen = true;
+}
+
+void latencyEnd(uint8_t source, unsigned long arrivalMicros) {
+  if (!latencyOutputSeen) {
+    return; // command did not change the output (e.g. invalid transition)
+  }
+  latencyOutputSeen = false;
+  uint32_t us = latencyOutputMicros - arrivalMicros;
+
+  portENTER_CRITICAL(&latencyMux);
+  LatencyStats& st = latencyStats[source][latencyStopping ? 1 : 0];
+  st.samples[st.next] = us;
+  st.next = (st.next + 1) % LATENCY_SAMPLES;
+  if (st.count < LATENCY_SAMPLES) {
+    st.count++;
+  }
+  st.total++;
+  if (us > st.max) {
+    st.max = us;
+  }
+  portEXIT_CRITICAL(&latencyMux);
+}
+
+// Source of the command that started the current motion, LATENCY_SOURCES if none
+uint8_t motionSource = LATENCY_SOURCES;
+
+// Whether switchPin was last driven HIGH by the FSM; guarded by fsmMutex
+bool motorPowered = false;
+
+void timedTrigger(int trigger, uint8_t source, unsigned long arrivalMicros) {
+  latencyBegin();
+  xSemaphoreTake(fsmMutex, portMAX_DELAY);
+  fsm.trigger(trigger);
+  int state = getStateIndex();
+  if (state != 2 && state != 3) {
+    motionSource = LATENCY_SOURCES;
+  } else if (trigger == forward || trigger == backward) {
+    motionSource = source;
+  }
+  xSemaphoreGive(fsmMutex);
+  latencyEnd(source, arrivalMicros);
+}
+
+void addLatencyReport(JsonObject obj, uint8_t source, uint8_t kind) {
+  LatencyStats st;
+  portENTER_CRITICAL(&latencyMux);
+  st = latencyStats[source][kind];
+  portEXIT_CRITICAL(&latencyMux);
+
+  std::sort(st.samples, st.samples + st.count);
+  obj["n"]   = st.total;
+  obj["p50"] = st.count ? st.samples[(st.count - 1) * 50 / 100] : 0;
+  obj["p99"] = st.count ? st.samples[(st.count - 1) * 99 / 100] : 0;
+  obj["max"] = st.max;
+}
+
+// Machine readable report, all values in microseconds, e.g.
+// {"uptime":123,"window":64,"websocket":{"move":{"n":3,"p50":..},"stop":{..}},..,
+//  "n2k":{"relayOn":{..},"relayOff":{..}}}
+String getLatencyReport() {
+  DynamicJsonDocument json(2048);
+  json["uptime"] = millis() / 1000;
+  json["window"] = LATENCY_SAMPLES;
+  for (uint8_t i = 0; i < LATENCY_SOURCES; i++) {
+    JsonObject src = json.createNestedObject(latencySourceNames[i]);
+    bool relay = (i == LATENCY_N2K);
+    addLatencyReport(src.createNestedObject(relay ? "relayOn" : "move"), i, 0);
+    addLatencyReport(src.createNestedObject(relay ? "relayOff" : "stop"), i, 1);
+  }
+
+  String response;
+  serializeJson(json, response);
+  return response;
+}
+
+void resetLatencyStats() {
+  portENTER_CRITICAL(&latencyMux);
+  memset(latencyStats, 0, sizeof(latencyStats));
+  portEXIT_CRITICAL(&latencyMux);
+}
+
+// --------------- MQTT BRIDGE ---------------
+// The client lives in its own task so that DNS lookups, TCP connects and
+// CONNACK waits against an unreachable broker never stall loop().
+WiFiClient mqttWifiClient;
+PubSubClient mqtt(mqttWifiClient);
+TaskHandle_t mqttTaskHandle = NULL;
+
+// Broker settings handed over from the loop task (setup / config changes)
+portMUX_TYPE mqttBrokerMux = portMUX_INITIALIZER_UNLOCKED;
+char mqttPendingBroker[sizeof(WinchConfig::mqttServer)] = "";
+uint16_t mqttPendingPort = MQTT_DEFAULT_PORT;
+bool mqttBrokerChanged = false;
+
+// Owned by the MQTT task
+char mqttBroker[sizeof(WinchConfig::mqttServer)] = "";
+uint16_t mqttBrokerPort = MQTT_DEFAULT_PORT;
+bool mqttBrokerResolved = false;
+bool mqttWasConnected = false;
+
+// State changes since the last publish; FSM callbacks may run on the
+// AsyncTCP task, so access is guarded by a spinlock.
+portMUX_TYPE mqttEventMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t mqttEvents[MQTT_MAX_EVENTS];
+uint8_t mqttEventCount = 0;
+
+// Bounded offline queue (ring buffer); the oldest payload is dropped when full
+char mqttQueue[MQTT_QUEUE_SIZE][MQTT_PAYLOAD_SIZE];
+uint8_t mqttQueueHead = 0;
+uint8_t mqttQueueCount = 0;
+
+// Last values sent, so we only publish deltas
+int mqttLastState = -1;
+int mqttLastRpm = -1;
+float mqttLastChainOut = -1;
+
+// Record a state change for the next batched publish
+void mqttQueueEvent() {
+  portENTER_CRITICAL(&mqttEventMux);
+  if (mqttEventCount < MQTT_MAX_EVENTS) {
+    mqttEvents[mqttEventCount++] = getStateIndex();
+  } else {
+    // keep the most recent ones
+    memmove(mqttEvents, mqttEvents + 1, MQTT_MAX_EVENTS - 1);
+    mqttEvents[MQTT_MAX_EVENTS - 1] = getStateIndex();
+  }
+  portEXIT_CRITICAL(&mqttEventMux);
+}
+
+void mqttEnqueue(const char* payload) {
+  uint8_t slot = (mqttQueueHead + mqttQueueCount) % MQTT_QUEUE_SIZE;
+  if (mqttQueueCount == MQTT_QUEUE_SIZE) {
+    mqttQueueHead = (mqttQueueHead + 1) % MQTT_QUEUE_SIZE;
+  } else {
+    mqttQueueCount++;
+  }
+  strlcpy(mqttQueue[slot], payload, MQTT_PAYLOAD_SIZE);
+}
+
+// Send queued payloads oldest first; stop at the first failure
+void mqttFlushQueue() {
+  while (mqttQueueCount > 0 && mqtt.connected()) {
+    if (!mqtt.publish(MQTT_TOPIC_TELEMETRY, mqttQueue[mqttQueueHead])) {
+      return;
+    }
+    mqttQueueHead = (mqttQueueHead + 1) % MQTT_QUEUE_SIZE;
+    mqttQueueCount--;
+  }
+}
+
+// Commands map 1:1 onto the FSM triggers
+void mqttCallback(char* topic, byte* payload, unsigned int length) {
+  unsigned long arrival = micros();
+  char cmd[16];
+  if (length >= sizeof(cmd)) {
+    return;
+  }
+  memcpy(cmd, payload, length);
+  cmd[length] = 0;
+
+  if (strcmp(cmd, "forward") == 0) {
+    timedTrigger(forward, LATENCY_MQTT, arrival);
+  } else if (strcmp(cmd, "backward") == 0) {
+    timedTrigger(backward, LATENCY_MQTT, arrival);
+  } else if (strcmp(cmd, "stop") == 0) {
+    timedTrigger(stop, LATENCY_MQTT, arrival);
+  } else if (strcmp(cmd, "toggleOn") == 0) {
+    timedTrigger(toggleOn, LATENCY_MQTT, arrival);
+  } else if (strcmp(cmd, "toggleOff") == 0) {
+    timedTrigger(toggleOff, LATENCY_MQTT, arrival);
+  } else {
+    Serial.printf("MQTT: unknown command %s\n", cmd);
+  }
+}
+
+// Runs on the MQTT task only
+void mqttReconnect() {
+  static unsigned long lastAttempt = 0;
+  if (lastAttempt != 0 && millis() - lastAttempt < MQTT_RECONNECT_INTERVAL) {
+    return;
+  }
+  lastAttempt = millis();
+
+  // resolve the broker once per configuration, not on every attempt
+  if (!mqttBrokerResolved) {
+    IPAddress brokerIp;
+    if (!WiFi.hostByName(mqttBroker, brokerIp)) {
+      Serial.printf("MQTT: cannot resolve %s\n", mqttBroker);
+      return;
+    }
+    mqtt.setServer(brokerIp, mqttBrokerPort);
+    mqttBrokerResolved = true;
+  }
+
+  String clientId = "anchorwinch-" + WiFi.macAddress();
+  if (mqtt.connect(clientId.c_str(), MQTT_TOPIC_STATUS, 0, true, "offline")) {
+    Serial.println("MQTT connected");
+    mqttWasConnected = true;
+    mqtt.publish(MQTT_TOPIC_STATUS, "online", true);
+    mqtt.subscribe(MQTT_TOPIC_COMMAND);
+    // force a full snapshot after (re)connecting
+    mqttLastState = -1;
+    mqttLastRpm = -1;
+    mqttLastChainOut = -1;
+  } else {
+    Serial.printf("MQTT connect failed, rc=%d\n", mqtt.state());
+  }
+}
+
+// Build a compact delta payload, e.g. {"s":2,"c":12.5,"r":40,"e":[1,2]}
+void mqttPublishTelemetry() {
+  StaticJsonDocument<256> json;
+
+  int state = getStateIndex();
+  if (state != mqttLastState) {
+    json["s"] = state;
+  }
+  if (chainOut != mqttLastChainOut) {
+    json["c"] = chainOut;
+  }
+  if (rpm != mqttLastRpm) {
+    json["r"] = rpm;
+  }
+
+  portENTER_CRITICAL(&mqttEventMux);
+  uint8_t events[MQTT_MAX_EVENTS];
+  uint8_t eventCount = mqttEventCount;
+  memcpy(events, mqttEvents, eventCount);
+  mqttEventCount = 0;
+  portEXIT_CRITICAL(&mqttEventMux);
+
+  if (eventCount > 0) {
+    JsonArray e = json.createNestedArray("e");
+    for (uint8_t i = 0; i < eventCount; i++) {
+      e.add(events[i]);
+    }
+  }
+
+  if (json.size() == 0) {
+    return; // nothing changed
+  }
+  mqttLastState = state;
+  mqttLastChainOut = chainOut;
+  mqttLastRpm = rpm;
+
+  char payload[MQTT_PAYLOAD_SIZE];
+  serializeJson(json, payload, sizeof(payload));
+
+  mqttFlushQueue();
+  if (mqttQueueCount > 0 || !mqtt.connected() ||
+      !mqtt.publish(MQTT_TOPIC_TELEMETRY, payload)) {
+    mqttEnqueue(payload);
+  }
+}
+
+// A motion commanded over MQTT must not outlive the connection that could stop it
+void mqttFailSafeStop() {
+  xSemaphoreTake(fsmMutex, portMAX_DELAY);
+  int state = getStateIndex();
+  if ((state == 2 || state == 3) && motionSource == LATENCY_MQTT) {
+    Serial.println("MQTT: connection lost, stopping motion started over MQTT");
+    fsm.trigger(stop);
+    motionSource = LATENCY_SOURCES;
+  }
+  xSemaphoreGive(fsmMutex);
+}
+
+// Hand a new broker to the MQTT task; an empty server disables the bridge
+void setMqttBroker(const char* server, uint16_t port) {
+  portENTER_CRITICAL(&mqttBrokerMux);
+  strlcpy(mqttPendingBroker, server, sizeof(mqttPendingBroker));
+  mqttPendingPort = port;
+  mqttBrokerChanged = true;
+  portEXIT_CRITICAL(&mqttBrokerMux);
+}
+
+void mqttTask(void *arg) {
+  unsigned long lastPublish = 0;
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(MQTT_TASK_PERIOD));
+
+    if (mqttBrokerChanged) {
+      portENTER_CRITICAL(&mqttBrokerMux);
+      memcpy(mqttBroker, mqttPendingBroker, sizeof(mqttBroker));
+      mqttBrokerPort = mqttPendingPort;
+      mqttBrokerChanged = false;
+      portEXIT_CRITICAL(&mqttBrokerMux);
+      mqtt.disconnect();
+      mqttBrokerResolved = false;
+    }
+    if (mqttWasConnected && !mqtt.connected()) {
+      mqttWasConnected = false;
+      mqttFailSafeStop();
+    }
+    if (mqttBroker[0] == 0) {
+      continue;
+    }
+
+    if (!mqtt.connected()) {
+      mqttReconnect();
+    } else {
+      mqtt.loop();
+      mqttFlushQueue();
+    }
+    if (millis() - lastPublish >= config.mqttInterval) {
+      lastPublish = millis();
+      mqttPublishTelemetry();
+    }
+  }
+}
+
+void initMqtt() {
+  if (strlen(config.mqttServer) == 0) {
+    Serial.println("MQTT disabled, no broker configured");
+  }
+  mqtt.setCallback(mqttCallback);
+  mqtt.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+  // QoS 0 publishes into a half-open socket (WiFi drop) still succeed, so a
+  // short keepalive bounds how long payloads go missing before we queue them
+  mqtt.setKeepAlive(MQTT_KEEPALIVE);
+  setMqttBroker(config.mqttServer, config.mqttPort);
+  // WiFi runs on core 0 as well; loop() keeps core 1 to itself
+  xTaskCreatePinnedToCore(mqttTask, "mqtt", MQTT_TASK_STACK, NULL, 1, &mqttTaskHandle, 0);
+}
+
+// --------------- RODE COUNTER & STATS LOG ---------------
+// Fixed-size record appended round-robin to RODE_LOG_SLOTS keys in NVS.
+// The newest valid record (highest seq with matching CRC) wins at boot.
+struct RodeRecord {
+  uint32_t seq;
+  int32_t  pulses;       // + = paid out
+  uint32_t motorMillis;  // total time spent spinning
+  uint32_t cycles;       // number of motor starts
+  uint32_t crc;          // over all fields above
+};
+
+Preferences rodeLog;
+RodeRecord rodeRecord = {};
+uint8_t rodeLogNextSlot = 0;
+unsigned long rodeLogLastWrite = 0;
+unsigned long rodeLogScanMicros = 0;
+uint32_t rodeLogBootWrites = 0;
+bool rodeLogStopPending = false;
+
+int32_t rodePulses = 0;
+int8_t rodeDirection = 1;
+uint32_t motorMillis = 0;
+uint32_t motorCycles = 0;
+
+uint32_t rodeRecordCrc(const RodeRecord& rec) {
+  return crc32_le(0, (const uint8_t*)&rec, offsetof(RodeRecord, crc));
+}
+
+void rodeLogKey(char* key, uint8_t slot) {
+  sprintf(key, "r%u", slot);
+}
+
+// Scan all slots once and restore the newest valid record
+void loadRodeLog() {
+  unsigned long start = micros();
+  rodeLog.begin(RODE_LOG_NAMESPACE, false);
+
+  bool found = false;
+  for (uint8_t i = 0; i < RODE_LOG_SLOTS; i++) {
+    char key[4];
+    RodeRecord rec;
+    rodeLogKey(key, i);
+    if (!rodeLog.isKey(key) ||
+        rodeLog.getBytes(key, &rec, sizeof(rec)) != sizeof(rec) ||
+        rec.crc != rodeRecordCrc(rec)) {
+      continue;
+    }
+    if (!found || rec.seq > rodeRecord.seq) {
+      rodeRecord = rec;
+      rodeLogNextSlot = (i + 1) % RODE_LOG_SLOTS;
+      found = true;
+    }
+  }
+
+  rodePulses  = rodeRecord.pulses;
+  motorMillis = rodeRecord.motorMillis;
+  motorCycles = rodeRecord.cycles;
+  chainOut    = rodePulses / config.pulsesPerMetre;
+  rodeLogScanMicros = micros() - start;
+
+  if (found) {
+    Serial.printf("rode log: seq %lu, chain out %.1f m (scan %lu us)\n",
+                  (unsigned long)rodeRecord.seq, chainOut, rodeLogScanMicros);
+  } else {
+    Serial.println("rode log: no valid record, starting from zero");
+  }
+}
+
+void writeRodeRecord() {
+  char key[4];
+  rodeRecord.seq++;
+  rodeRecord.pulses      = rodePulses;
+  rodeRecord.motorMillis = motorMillis;
+  rodeRecord.cycles      = motorCycles;
+  rodeRecord.crc         = rodeRecordCrc(rodeRecord);
+
+  rodeLogKey(key, rodeLogNextSlot);
+  if (rodeLog.putBytes(key, &rodeRecord, sizeof(rodeRecord)) != sizeof(rodeRecord)) {
+    Serial.println("rode log: write failed");
+  }
+  rodeLogNextSlot = (rodeLogNextSlot + 1) % RODE_LOG_SLOTS;
+  rodeLogLastWrite = millis();
+  rodeLogBootWrites++;
+}
+
+void initRodeCounter() {
+  pcnt_config_t pcnt = {};
+  pcnt.pulse_gpio_num = PCNT_PIN;
+  pcnt.ctrl_gpio_num  = PCNT_PIN_NOT_USED;
+  pcnt.channel        = PCNT_CHANNEL_0;
+  pcnt.unit           = RODE_PCNT_UNIT;
+  pcnt.pos_mode       = PCNT_COUNT_INC;
+  pcnt.neg_mode       = PCNT_COUNT_DIS;
+  pcnt.lctrl_mode     = PCNT_MODE_KEEP;
+  pcnt.hctrl_mode     = PCNT_MODE_KEEP;
+  pcnt.counter_h_lim  = INT16_MAX;
+  pcnt.counter_l_lim  = 0;
+  pcnt_unit_config(&pcnt);
+  // pcnt_unit_config() enables the pull-up, the sensor needs the pull-down
+  gpio_pullup_dis((gpio_num_t)PCNT_PIN);
+  gpio_pulldown_en((gpio_num_t)PCNT_PIN);
+
+  pcnt_set_filter_value(RODE_PCNT_UNIT, 1000);
+  pcnt_filter_enable(RODE_PCNT_UNIT);
+  pcnt_counter_clear(RODE_PCNT_UNIT);
+  pcnt_counter_resume(RODE_PCNT_UNIT);
+}
+
+// Called from loop(): count pulses, track runtime and decide when to persist.
+// NVS writes can stall both cores for tens of ms on a page erase, so while
+// the motor runs only a sparse checkpoint is written. The record is written
+// on stop, and again once the chain has settled if it kept running out
+// (coasting, or freefall with the clutch released). Never called from the
+// FSM callbacks.
+void handleRodeCounter() {
+  static bool wasMoving = false;
+  static unsigned long lastTick = millis();
+  static unsigned long rpmWindowStart = millis();
+  static unsigned long lastPulse = 0;
+  static unsigned long stopTime = 0;
+  static uint32_t rpmPulses = 0;
+  unsigned long now = millis();
+
+  // book the pulses since the last pass with the direction that was in
+  // effect for them, before looking at the new state
+  int16_t count = 0;
+  pcnt_get_counter_value(RODE_PCNT_UNIT, &count);
+  if (count != 0) {
+    pcnt_counter_clear(RODE_PCNT_UNIT);
+    rodePulses += rodeDirection * count;
+    chainOut = rodePulses / config.pulsesPerMetre;
+    rpmPulses += count;
+    lastPulse = now;
+  }
+  if (now - rpmWindowStart >= RPM_WINDOW) {
+    rpm = rpmPulses * 60000UL / ((now - rpmWindowStart) * PULSES_PER_REVOLUTION);
+    rpmPulses = 0;
+    rpmWindowStart = now;
+  }
+
+  int state = getStateIndex();
+  bool moving = (state == 2 || state == 3);
+  if (moving) {
+    // spinForward pays out, spinBackward hauls in
+    rodeDirection = (state == 2) ? 1 : -1;
+    motorMillis += now - lastTick;
+    if (!wasMoving) {
+      motorCycles++;
+    }
+  } else {
+    if (wasMoving) {
+      rodeLogStopPending = true;
+      stopTime = now;
+    }
+    // undriven chain can only run out; allow a short coast after a haul-in
+    if (now - stopTime >= RODE_COAST_TIME) {
+      rodeDirection = 1;
+    }
+  }
+  wasMoving = moving;
+  lastTick = now;
+
+  if (now - rodeLogLastWrite < RODE_LOG_MIN_INTERVAL) {
+    return;
+  }
+  if (moving) {
+    if (now - rodeLogLastWrite >= RODE_LOG_MOVING_INTERVAL) {
+      writeRodeRecord();
+    }
+  } else if (rodeLogStopPending ||
+             (rodePulses != rodeRecord.pulses && now - lastPulse >= RODE_LOG_SETTLE_TIME)) {
+    rodeLogStopPending = false;
+    writeRodeRecord();
+  }
+}
+
+String getRodeStats() {
+  StaticJsonDocument<384> json;
+  json["chainOut"]    = chainOut;
+  json["pulses"]      = rodePulses;
+  json["motorHours"]  = motorMillis / 3600000.0;
+  json["cycles"]      = motorCycles;
+  json["writes"]      = rodeRecord.seq;
+  json["bootWrites"]  = rodeLogBootWrites;
+  json["scanMicros"]  = rodeLogScanMicros;
+
+  // NVS moves entries between pages itself; report its own occupancy
+  nvs_stats_t nvs;
+  if (nvs_get_stats(NULL, &nvs) == ESP_OK) {
+    JsonObject flash = json.createNestedObject("nvs");
+    flash["usedEntries"]  = nvs.used_entries;
+    flash["freeEntries"]  = nvs.free_entries;
+    flash["totalEntries"] = nvs.total_entries;
+  }
+
+  String response;
+  serializeJson(json, response);
+  return response;
+}
+
+// --------------- SPEED RAMP ---------------
+// The ramp end points are fixed when the motor engages; moving the slider
+// mid-ramp only takes effect on the next start, as without a ramp.
+unsigned long rampStart = 0;
+int32_t rampFrom = 0;
+int32_t rampTo = 0;
+bool ramping = false;
+
+uint32_t targetFrequency() {
+  return (uint32_t)config.maxFreq * dutyCycle / 255;
+}
+
+// Set the starting frequency when the motor is engaged
+void startRamp() {
+  rampStart = millis();
+  rampFrom  = config.minFreq;
+  rampTo    = targetFrequency();
+  ramping   = config.rampUpMs > 0 && rampTo > rampFrom;
+  ledcWriteTone(PWM_CHANNEL, ramping ? rampFrom : rampTo);
+}
+
+// Step linearly from minFreq to the target over rampUpMs. The FSM lock is
+// held from the state check through the write, so a stop arriving from the
+// AsyncTCP or MQTT task can't be followed by a stale ramp step.
+void handleRamp() {
+  static unsigned long lastStep = 0;
+  unsigned long now = millis();
+  if (!ramping || now - lastStep < RAMP_STEP_MS) {
+    return;
+  }
+  lastStep = now;
+
+  xSemaphoreTake(fsmMutex, portMAX_DELAY);
+  int state = getStateIndex();
+  if (!ramping || (state != 2 && state != 3)) {
+    ramping = false;
+  } else {
+    int32_t elapsed = now - rampStart;
+    if (elapsed >= (int32_t)config.rampUpMs) {
+      ledcWriteTone(PWM_CHANNEL, rampTo);
+      ramping = false;
+    } else {
+      int32_t freq = rampFrom + (int64_t)(rampTo - rampFrom) * elapsed / config.rampUpMs;
+      ledcWriteTone(PWM_CHANNEL, constrain(freq, rampFrom, rampTo));
+    }
+  }
+  xSemaphoreGive(fsmMutex);
+}
+
 // ---------- FSM STATE CALLBACKS ----------
 void on_off() {
   Serial.println("FSM state: OFF");
-  digitalWrite(switchPin, LOW);           // fully off
-  ledcWriteTone(PWM_CHANNEL, MIN_FREQ);   // ensure minimal PWM
+  digitalWrite(config.switchPin, LOW);    // fully off
+  if (motorPowered) {
+    motorPowered = false;
+    latencyOutput(true);
+  }
+  ledcWriteTone(PWM_CHANNEL, config.minFreq); // ensure minimal PWM
   // now we can notify all web clients
   ws.textAll(getState());
+  mqttQueueEvent();
 }
 
 void on_break() {
   Serial.println("FSM state: BREAK");
   // system is on but motor is not spinning
-  digitalWrite(switchPin, LOW);
-  ledcWriteTone(PWM_CHANNEL, MIN_FREQ);
+  digitalWrite(config.switchPin, LOW);
+  if (motorPowered) {
+    motorPowered = false;
+    latencyOutput(true);
+  }
+  ledcWriteTone(PWM_CHANNEL, config.minFreq);
   ws.textAll(getState());
+  mqttQueueEvent();
 }
 
 void on_spinForward() {
   Serial.println("FSM state: spinning FORWARD");
   // reverse pin off
-  digitalWrite(switchPin, LOW);
-  ledcWriteTone(PWM_CHANNEL, MAX_FREQ * dutyCycle / 255);
-  digitalWrite(reversePin, HIGH);
+  digitalWrite(config.switchPin, LOW);
+  startRamp();
+  digitalWrite(config.reversePin, HIGH);
   // Now engage motor power
-  digitalWrite(switchPin, HIGH);
+  digitalWrite(config.switchPin, HIGH);
+  motorPowered = true;
+  latencyOutput(false);
   ws.textAll(getState());
+  mqttQueueEvent();
 }
 
 void on_spinBackward() {
   Serial.println("FSM state: spinning BACKWARD");
-  digitalWrite(switchPin, LOW);
-  digitalWrite(reversePin, LOW);
-  ledcWriteTone(PWM_CHANNEL, MAX_FREQ * dutyCycle / 255);
-  digitalWrite(switchPin, HIGH);
+  digitalWrite(config.switchPin, LOW);
+  digitalWrite(config.reversePin, LOW);
+  startRamp();
+  digitalWrite(config.switchPin, HIGH);
+  motorPowered = true;
+  latencyOutput(false);
   ws.textAll(getState());
+  mqttQueueEvent();
 }
 
 // --------------- HTML PAGE ---------------
@@ -318,7 +1093,7 @@ String processor(const String& var) {
     String speed;
     speed += "<p>PWM speed set: <span id=\"valueForPwmSlider\">" + String(dutyCycle) + "</span></p>";
     speed += "<p><input type=\"range\" onchange=\"updateSliderPWM(";
-    speed += String(pwmPin);
+    speed += String(config.pwmPin);
     speed += ", this)\" id=\"PwmSlider\" min=\"0\" max=\"255\" value=\"";
     speed += String(dutyCycle);
     speed += "\" step=\"1\" class=\"slider\"></p>";
@@ -337,60 +1112,289 @@ String processor(const String& var) {
   return String();
 }
 
-// ----------- SPIFFS CONFIG STORAGE -----------
-bool shouldSaveConfig = false;
-void saveConfigCallback() {
-  Serial.println("Should save config");
-  shouldSaveConfig = true;
+// ----------- NVS CONFIG STORAGE -----------
+Preferences configStore;
+
+// Config changes arrive on the AsyncTCP task and are applied from loop()
+portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED;
+WinchConfig pendingConfig;
+bool configPending = false;
+uint32_t configPendingSeq = 0; // bumped on every accepted POST
+
+void saveConfig() {
+  uint8_t blob[sizeof(ConfigHeader) + sizeof(WinchConfig)];
+  ConfigHeader header;
+  header.version = CONFIG_VERSION;
+  header.size    = sizeof(WinchConfig);
+  header.crc     = crc32_le(0, (const uint8_t*)&config, sizeof(WinchConfig));
+  memcpy(blob, &header, sizeof(header));
+  memcpy(blob + sizeof(header), &config, sizeof(WinchConfig));
+
+  if (configStore.putBytes(CONFIG_KEY, blob, sizeof(blob)) != sizeof(blob)) {
+    Serial.println("failed to write config");
+  }
 }
 
-void saveConfigFile() {
-  Serial.println(F("Saving config"));
-  StaticJsonDocument<512> json;
-  json["switchPin"] = switchPin;
-  json["pwmPin"]    = pwmPin;
-  json["reversePin"] = reversePin;
+// Pins a config may never claim: serial console, SPI flash, and everything
+// this firmware already drives or reads. Driving a flash pin crashes the chip,
+// and a saved config is re-applied at every boot.
+const uint8_t reservedPins[] = {
+  1, 3,                                   // UART0 (Serial)
+  6, 7, 8, 9, 10, 11,                     // SPI flash
+  BUTTON_DOWN_PIN, BUTTON_UP_PIN,
+  RADIO_BUTTON_DOWN_PIN, RADIO_BUTTON_UP_PIN,
+  PCNT_PIN,
+  (uint8_t)CAN_TX_PIN, (uint8_t)CAN_RX_PIN,
+  23                                      // N2K relay, CzRelayPinMap[0]
+};
+
+bool isUsableOutputPin(uint8_t pin) {
+  if (!GPIO_IS_VALID_OUTPUT_GPIO(pin)) {
+    return false;
+  }
+  for (uint8_t i = 0; i < sizeof(reservedPins); i++) {
+    if (reservedPins[i] == pin) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns an error message, or NULL if the config is usable
+const char* validateConfig(const WinchConfig& c) {
+  if (!isUsableOutputPin(c.switchPin) ||
+      !isUsableOutputPin(c.pwmPin) ||
+      !isUsableOutputPin(c.reversePin)) {
+    return "invalid or reserved output pin";
+  }
+  if (c.switchPin == c.pwmPin || c.switchPin == c.reversePin || c.pwmPin == c.reversePin) {
+    return "pins must be distinct";
+  }
+  if (c.minFreq == 0 || c.maxFreq <= c.minFreq) {
+    return "invalid PWM limits";
+  }
+  if (!(c.pulsesPerMetre > 0)) {
+    return "pulsesPerMetre must be positive";
+  }
+  if (c.mqttInterval == 0) {
+    return "mqttInterval must be positive";
+  }
+  if (c.mqttPort == 0) {
+    return "mqttPort must be positive";
+  }
+  return NULL;
+}
+
+// Copy the stored blob straight into `config`; no parsing involved
+bool loadConfig() {
+  config = defaultConfig;
+  configStore.begin(CONFIG_NAMESPACE, false);
+  if (!configStore.isKey(CONFIG_KEY)) {
+    Serial.println("no stored config, using defaults");
+    return false;
+  }
+
+  uint8_t blob[CONFIG_MAX_SIZE];
+  ConfigHeader header;
+  size_t len = configStore.getBytes(CONFIG_KEY, blob, sizeof(blob));
+  if (len < sizeof(header)) {
+    Serial.println("stored config unreadable, using defaults");
+    return false;
+  }
+  memcpy(&header, blob, sizeof(header));
+  if (header.version == 0 || header.version > CONFIG_VERSION) {
+    // written by newer firmware; its fields may mean something else
+    Serial.printf("stored config v%u not supported, using defaults\n", header.version);
+    return false;
+  }
+  if (header.size != len - sizeof(header) ||
+      header.crc != crc32_le(0, blob + sizeof(header), header.size)) {
+    Serial.println("stored config corrupt, using defaults");
+    return false;
+  }
+
+  // Migration: every older version's layout is a prefix of this one, so its
+  // bytes load over the defaults and the fields it lacks keep their default.
+  // Add per-version fix-ups here if a field ever changes meaning.
+  memcpy(&config, blob + sizeof(header), std::min((size_t)header.size, sizeof(WinchConfig)));
+  config.mqttServer[sizeof(config.mqttServer) - 1] = 0;
+  const char* error = validateConfig(config);
+  if (error) {
+    Serial.printf("stored config rejected (%s), using defaults\n", error);
+    config = defaultConfig;
+    return false;
+  }
+  Serial.printf("config v%u loaded\n", header.version);
+  return true;
+}
+
+// Apply a new config without a reboot. Only called while the motor is stopped.
+void applyConfig(const WinchConfig& next) {
+  WinchConfig prev = config;
+  config = next;
+
+  // Pins may swap roles (e.g. switch <-> reverse), so release every old pin
+  // before any new one is driven. Released pins are pulled low rather than
+  // left floating, so a driver input on them reads "off".
+  if (next.switchPin != prev.switchPin || next.reversePin != prev.reversePin ||
+      next.pwmPin != prev.pwmPin) {
+    ledcDetachPin(prev.pwmPin);
+    const uint8_t released[] = { prev.switchPin, prev.reversePin, prev.pwmPin };
+    for (uint8_t pin : released) {
+      digitalWrite(pin, LOW);
+      pinMode(pin, INPUT_PULLDOWN);
+    }
 
-  File configFile = SPIFFS.open(JSON_CONFIG_FILE, "w");
-  if (!configFile) {
-    Serial.println("failed to open config file for writing");
+    pinMode(next.switchPin, OUTPUT);
+    digitalWrite(next.switchPin, LOW);
+    pinMode(next.reversePin, OUTPUT);
+    digitalWrite(next.reversePin, HIGH);
+    ledcAttachPin(next.pwmPin, PWM_CHANNEL);
+  }
+  if (next.minFreq != prev.minFreq) {
+    ledcWriteTone(PWM_CHANNEL, next.minFreq);
+  }
+  if (next.dutyCycle != prev.dutyCycle) {
+    dutyCycle = next.dutyCycle;
+  }
+  chainOut = rodePulses / next.pulsesPerMetre;
+
+  if (strcmp(next.mqttServer, prev.mqttServer) != 0 || next.mqttPort != prev.mqttPort) {
+    setMqttBroker(next.mqttServer, next.mqttPort);
+  }
+}
+
+void handleConfig() {
+  if (!configPending) {
     return;
   }
-  serializeJsonPretty(json, Serial);
-  if (serializeJson(json, configFile) == 0) {
-    Serial.println(F("Failed to write to file"));
-  }
-  configFile.close();
-}
-
-bool loadConfigFile() {
-  Serial.println("mounting FS...");
-  if (SPIFFS.begin(false) || SPIFFS.begin(true)) {
-    Serial.println("mounted file system");
-    if (SPIFFS.exists(JSON_CONFIG_FILE)) {
-      Serial.println("reading config file");
-      File configFile = SPIFFS.open(JSON_CONFIG_FILE, "r");
-      if (configFile) {
-        Serial.println("opened config file");
-        StaticJsonDocument<512> json;
-        DeserializationError error = deserializeJson(json, configFile);
-        serializeJsonPretty(json, Serial);
-        if (!error) {
-          Serial.println("\nparsed json");
-          // If you want to load from the file:
-          //switchPin  = json["switchPin"].as<int>();
-          //pwmPin     = json["pwmPin"].as<int>();
-          //reversePin = json["reversePin"].as<int>();
-          return true;
-        } else {
-          Serial.println("failed to load json config");
-        }
-      }
+  // never swap pins under a running motor; wait for it to stop. The FSM
+  // lock is held from the check until the pins are switched, so no trigger
+  // can start the motor in between.
+  xSemaphoreTake(fsmMutex, portMAX_DELAY);
+  int state = getStateIndex();
+  if (state == 2 || state == 3) {
+    xSemaphoreGive(fsmMutex);
+    return;
+  }
+
+  WinchConfig next;
+  portENTER_CRITICAL(&configMux);
+  next = pendingConfig;
+  uint32_t seq = configPendingSeq;
+  portEXIT_CRITICAL(&configMux);
+
+  applyConfig(next);
+  xSemaphoreGive(fsmMutex);
+
+  // stays pending while applying so a concurrent POST builds on it; a POST
+  // that arrived meanwhile is picked up on the next pass
+  portENTER_CRITICAL(&configMux);
+  if (seq == configPendingSeq) {
+    configPending = false;
+  }
+  portEXIT_CRITICAL(&configMux);
+
+  saveConfig();
+  Serial.println("config applied");
+}
+
+// JSON is only used as the HTTP import/export format
+void exportConfig(const WinchConfig& c, JsonObject json) {
+  json["version"]               = CONFIG_VERSION;
+  json["switchPin"]             = c.switchPin;
+  json["pwmPin"]                = c.pwmPin;
+  json["reversePin"]            = c.reversePin;
+  json["minFreq"]               = c.minFreq;
+  json["maxFreq"]               = c.maxFreq;
+  json["dutyCycle"]             = c.dutyCycle;
+  json["rampUpMs"]              = c.rampUpMs;
+  json["n2kDeviceInstance"]     = c.n2kDeviceInstance;
+  json["n2kSwitchBankInstance"] = c.n2kSwitchBankInstance;
+  json["pulsesPerMetre"]        = c.pulsesPerMetre;
+  json["mqttServer"]            = c.mqttServer;
+  json["mqttPort"]              = c.mqttPort;
+  json["mqttInterval"]          = c.mqttInterval;
+}
+
+// Fields missing from the JSON keep their current value
+// Absent keys keep their value; a present key must hold a value of the
+// field's type that fits its range (is<T>() checks both)
+template <typename T>
+bool importField(JsonObject json, const char* key, T& field) {
+  JsonVariant v = json[key];
+  if (v.isNull()) {
+    return true;
+  }
+  if (!v.is<T>()) {
+    return false;
+  }
+  field = v.as<T>();
+  return true;
+}
+
+// Returns the first offending key, or NULL when all present keys were taken
+const char* importConfig(JsonObject json, WinchConfig& c) {
+  if (!importField(json, "switchPin", c.switchPin))                         return "switchPin";
+  if (!importField(json, "pwmPin", c.pwmPin))                               return "pwmPin";
+  if (!importField(json, "reversePin", c.reversePin))                       return "reversePin";
+  if (!importField(json, "minFreq", c.minFreq))                             return "minFreq";
+  if (!importField(json, "maxFreq", c.maxFreq))                             return "maxFreq";
+  if (!importField(json, "dutyCycle", c.dutyCycle))                         return "dutyCycle";
+  if (!importField(json, "rampUpMs", c.rampUpMs))                           return "rampUpMs";
+  if (!importField(json, "n2kDeviceInstance", c.n2kDeviceInstance))         return "n2kDeviceInstance";
+  if (!importField(json, "n2kSwitchBankInstance", c.n2kSwitchBankInstance)) return "n2kSwitchBankInstance";
+  if (!importField(json, "pulsesPerMetre", c.pulsesPerMetre))               return "pulsesPerMetre";
+  if (!importField(json, "mqttPort", c.mqttPort))                           return "mqttPort";
+  if (!importField(json, "mqttInterval", c.mqttInterval))                   return "mqttInterval";
+
+  JsonVariant server = json["mqttServer"];
+  if (!server.isNull()) {
+    if (!server.is<const char*>() || strlen(server.as<const char*>()) >= sizeof(c.mqttServer)) {
+      return "mqttServer";
     }
-  } else {
-    Serial.println("failed to mount FS");
+    strlcpy(c.mqttServer, server.as<const char*>(), sizeof(c.mqttServer));
   }
-  return false;
+  return NULL;
+}
+
+String getConfigJson(const WinchConfig& c) {
+  StaticJsonDocument<512> json;
+  exportConfig(c, json.to<JsonObject>());
+
+  String response;
+  serializeJson(json, response);
+  return response;
+}
+
+void handleConfigImport(AsyncWebServerRequest *request, JsonVariant &json) {
+  if (!json.is<JsonObject>()) {
+    request->send(400, "text/plain", "expected a JSON object");
+    return;
+  }
+  // build on an update that is still waiting for the loop, not just the
+  // applied config, so back-to-back partial POSTs don't undo each other
+  WinchConfig next;
+  portENTER_CRITICAL(&configMux);
+  next = configPending ? pendingConfig : config;
+  portEXIT_CRITICAL(&configMux);
+  const char* badKey = importConfig(json.as<JsonObject>(), next);
+  if (badKey) {
+    request->send(400, "text/plain", String("invalid value for ") + badKey);
+    return;
+  }
+  const char* error = validateConfig(next);
+  if (error) {
+    request->send(400, "text/plain", error);
+    return;
+  }
+
+  portENTER_CRITICAL(&configMux);
+  pendingConfig = next;
+  configPending = true;
+  configPendingSeq++;
+  portEXIT_CRITICAL(&configMux);
+  request->send(200, "application/json", getConfigJson(next));
 }
 
 void configModeCallback(WiFiManager *myWiFiManager) {
@@ -402,7 +1406,7 @@ void configModeCallback(WiFiManager *myWiFiManager) {
 }
 
 // ----------- WEBSOCKET CALLBACK -----------
-void handleWebSocketMessage(void *arg, uint8_t *data, size_t len) {
+void handleWebSocketMessage(void *arg, uint8_t *data, size_t len, unsigned long arrival) {
   AwsFrameInfo *info = (AwsFrameInfo*)arg;
   if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT) {
     data[len] = 0;
@@ -415,15 +1419,15 @@ void handleWebSocketMessage(void *arg, uint8_t *data, size_t len) {
     }
 
     if (strcmp(dataStr, "down") == 0) {
-      fsm.trigger(forward);
+      timedTrigger(forward, LATENCY_WEBSOCKET, arrival);
     } else if (strcmp(dataStr, "up") == 0) {
-      fsm.trigger(backward);
+      timedTrigger(backward, LATENCY_WEBSOCKET, arrival);
     } else if (strcmp(dataStr, "stop") == 0) {
-      fsm.trigger(stop);
+      timedTrigger(stop, LATENCY_WEBSOCKET, arrival);
     } else if (strcmp(dataStr, "switchHigh") == 0) {
-      fsm.trigger(toggleOn);   // OFF -> ON
+      timedTrigger(toggleOn, LATENCY_WEBSOCKET, arrival);   // OFF -> ON
     } else if (strcmp(dataStr, "switchLow") == 0) {
-      fsm.trigger(toggleOff);  // ON -> OFF
+      timedTrigger(toggleOff, LATENCY_WEBSOCKET, arrival);  // ON -> OFF
     } else if (strstr(dataStr, "slider-")) {
       int val = atoi(&dataStr[7]);
       Serial.printf("found slider value: %u \n", val);
@@ -446,7 +1450,7 @@ void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
       Serial.printf("WebSocket client #%u disconnected\n", client->id());
       break;
     case WS_EVT_DATA:
-      handleWebSocketMessage(arg, data, len);
+      handleWebSocketMessage(arg, data, len, micros());
       break;
     case WS_EVT_PONG:
     case WS_EVT_ERROR:
@@ -462,6 +1466,22 @@ void initWebSocket() {
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
     request->send_P(200, "text/html", index_html, processor);
   });
+
+  server.on("/config", HTTP_GET, [](AsyncWebServerRequest *request){
+    request->send(200, "application/json", getConfigJson(config));
+  });
+  server.addHandler(new AsyncCallbackJsonWebHandler("/config", handleConfigImport));
+
+  server.on("/stats", HTTP_GET, [](AsyncWebServerRequest *request){
+    request->send(200, "application/json", getRodeStats());
+  });
+
+  server.on("/latency", HTTP_GET, [](AsyncWebServerRequest *request){
+    request->send(200, "application/json", getLatencyReport());
+    if (request->hasParam("reset")) {
+      resetLatencyStats();
+    }
+  });
 }
 
 // --------------- N2K SWITCH HANDLING ---------------
@@ -487,7 +1507,7 @@ void SetCZoneSwitchChangeRequest127502(unsigned char DeviceInstance, uint8_t Swi
   N2kSetStatusBinaryOnStatus(CzBankStatus,
                              ItemStatus ? N2kOnOff_On : N2kOnOff_Off,
                              SwitchIndex);
-  SetN2kSwitchBankCommand(N2kMsg, SwitchBankInstance, CzBankStatus);
+  SetN2kSwitchBankCommand(N2kMsg, config.n2kSwitchBankInstance, CzBankStatus);
   nmea2000->SendMsg(N2kMsg);
 }
 
@@ -499,23 +1519,26 @@ void SetChangeSwitchState(uint8_t SwitchIndex, bool ItemStatus) {
     if (ItemStatus) {
       Serial.println("writing pin high");
       digitalWrite(CzRelayPinMap[SwitchIndex - 1], HIGH);
+      latencyOutput(false);
     } else {
       Serial.println("writing pin low");
       digitalWrite(CzRelayPinMap[SwitchIndex - 1], LOW);
+      latencyOutput(true);
     }
   }
   // broadcast the updated states
-  SetCZoneSwitchState127501(BinaryDeviceInstance);
-  SetCZoneSwitchChangeRequest127502(SwitchBankInstance, SwitchIndex, ItemStatus);
+  SetCZoneSwitchState127501(config.n2kDeviceInstance);
+  SetCZoneSwitchChangeRequest127502(config.n2kSwitchBankInstance, SwitchIndex, ItemStatus);
 }
 
 void ParseN2kPGN127502(const tN2kMsg& N2kMsg) {
+  latencyBegin();
   tN2kOnOff State;
   unsigned char ChangeIndex;
   int Index = 0;
   uint8_t DeviceBankInstance = N2kMsg.GetByte(Index);
 
-  if (N2kMsg.PGN != 127502L || DeviceBankInstance != BinaryDeviceInstance) {
+  if (N2kMsg.PGN != 127502L || DeviceBankInstance != config.n2kDeviceInstance) {
     return;
   }
 
@@ -571,6 +1594,7 @@ void ParseN2kPGN127502(const tN2kMsg& N2kMsg) {
       SetChangeSwitchState(8, CzSwitchState2 & 0x08);
       break;
   }
+  latencyEnd(LATENCY_N2K, n2kDrainMicros);
 }
 
 // Periodic heartbeat
@@ -578,84 +1602,50 @@ void SendN2k(void) {
   static unsigned long CzUpdate127501 = millis();
   if (CzUpdate127501 + CzUpdatePeriod127501 < millis()) {
     CzUpdate127501 = millis();
-    SetCZoneSwitchState127501(BinaryDeviceInstance);
+    SetCZoneSwitchState127501(config.n2kDeviceInstance);
   }
 }
 
 // ------------ SETUP & LOOP ------------
 void setup() {
   Serial.begin(115200);
+  fsmMutex = xSemaphoreCreateMutex();
 
-  bool forceConfig = false;
-  bool spiffsSetup = loadConfigFile();
-  if (!spiffsSetup) {
-    Serial.println(F("Forcing config mode as there is no saved config"));
-    forceConfig = true;
-  }
+  // config is a straight copy out of NVS; the rode counter needs its
+  // calibration, and both are restored before anything slow (WiFi, portal) runs
+  loadConfig();
+  dutyCycle = config.dutyCycle;
+  loadRodeLog();
 
   WiFi.mode(WIFI_STA);
   WiFiManager wm;
-  wm.setSaveConfigCallback(saveConfigCallback);
   wm.setAPCallback(configModeCallback);
 
-  // Optional extra config parameters
-  char switch_pin_str[2];
-  sprintf(switch_pin_str, "%d", switchPin);
-  WiFiManagerParameter switch_pin_num("switch_pin", "GPIO # for switch", switch_pin_str, 2);
-
-  char convertedValue[7];
-  sprintf(convertedValue, "%d", pwmPin);
-  WiFiManagerParameter pwm_pin_num("pwm_pin", "GPIO # for PWM", convertedValue, 7);
-
-  sprintf(convertedValue, "%d", reversePin);
-  WiFiManagerParameter reverse_pin_num("reverse_pin", "GPIO # for forward/reverse", convertedValue, 7);
-
-  wm.addParameter(&switch_pin_num);
-  wm.addParameter(&pwm_pin_num);
-  wm.addParameter(&reverse_pin_num);
-
-  if (forceConfig) {
-    if (!wm.startConfigPortal("WifiTetris")) {
-      Serial.println("failed to connect and hit timeout");
-      delay(3000);
-      ESP.restart();
-      delay(5000);
-    }
-  } else {
-    if (!wm.autoConnect("WifiTetris")) {
-      Serial.println("failed to connect and hit timeout");
-      delay(3000);
-      ESP.restart();
-      delay(5000);
-    }
+  // opens the config portal if there are no saved credentials
+  if (!wm.autoConnect("WifiTetris")) {
+    Serial.println("failed to connect and hit timeout");
+    delay(3000);
+    ESP.restart();
+    delay(5000);
   }
 
   Serial.println("WiFi connected");
   Serial.print("IP address: ");
   Serial.println(WiFi.localIP());
 
-  // Possibly load param values from web manager
-  // switchPin  = atoi(switch_pin_num.getValue());
-  pwmPin     = atoi(pwm_pin_num.getValue());
-  reversePin = atoi(reverse_pin_num.getValue());
-
-  if (shouldSaveConfig) {
-    saveConfigFile();
-  }
-
   // ----- FSM -----
   fsm.add(transitions, num_transitions);
   fsm.setInitialState(&s[0]); // Start OFF
 
   // ----- I/O PINS -----
-  pinMode(switchPin, OUTPUT);
-  digitalWrite(switchPin, LOW);
+  pinMode(config.switchPin, OUTPUT);
+  digitalWrite(config.switchPin, LOW);
 
-  pinMode(reversePin, OUTPUT);
-  digitalWrite(reversePin, HIGH);
+  pinMode(config.reversePin, OUTPUT);
+  digitalWrite(config.reversePin, HIGH);
 
-  ledcSetup(PWM_CHANNEL, MIN_FREQ, PWM_RESOLUTION);
-  ledcAttachPin(pwmPin, PWM_CHANNEL);
+  ledcSetup(PWM_CHANNEL, config.minFreq, PWM_RESOLUTION);
+  ledcAttachPin(config.pwmPin, PWM_CHANNEL);
 
   // Example: real pin for CzRelayPinMap[0]=23
   pinMode(CzRelayPinMap[0], OUTPUT);
@@ -663,6 +1653,7 @@ void setup() {
   // We do NOT do pinMode on pin 5, since that is “virtual”.
 
   pinMode(PCNT_PIN, INPUT_PULLDOWN);
+  initRodeCounter();
 
   // local pushbuttons
   buttonDown.attach(BUTTON_DOWN_PIN, INPUT_PULLUP);
@@ -680,10 +1671,16 @@ void setup() {
   radioButtonDown.setPressedState(LOW);
   radioButtonUp.setPressedState(LOW);
 
+  // timestamp button edges for the latency figures
+  initLatencyEdges();
+
   // WebSocket init & server start
   initWebSocket();
   server.begin();
 
+  // MQTT telemetry & commands
+  initMqtt();
+
   // ----- NMEA2000 -----
   nmea2000 = new tNMEA2000_esp32(CAN_TX_PIN, CAN_RX_PIN);
   N2kResetBinaryStatus(CzBankStatus);
@@ -697,11 +1694,14 @@ void setup() {
   nmea2000->SetMsgHandler(ParseN2kPGN127502);
   nmea2000->Open();
   delay(200);
+  n2kDrainMicros = micros();
 }
 
 void loop() {
   ws.cleanupClients();
+  xSemaphoreTake(fsmMutex, portMAX_DELAY);
   fsm.run();
+  xSemaphoreGive(fsmMutex);
 
   buttonDown.update();
   buttonUp.update();
@@ -709,20 +1709,38 @@ void loop() {
   radioButtonUp.update();
 
   // Pressing "down" => forward
-  if (buttonDown.pressed() || radioButtonDown.pressed()) {
-    fsm.trigger(forward);
+  if (buttonDown.pressed()) {
+    timedTrigger(forward, LATENCY_BUTTON, latencyEdgeArrival(EDGE_BUTTON_DOWN));
+  } else if (radioButtonDown.pressed()) {
+    timedTrigger(forward, LATENCY_RADIO, latencyEdgeArrival(EDGE_RADIO_DOWN));
   }
   // Pressing "up" => backward
-  if (buttonUp.pressed() || radioButtonUp.pressed()) {
-    fsm.trigger(backward);
+  if (buttonUp.pressed()) {
+    timedTrigger(backward, LATENCY_BUTTON, latencyEdgeArrival(EDGE_BUTTON_UP));
+  } else if (radioButtonUp.pressed()) {
+    timedTrigger(backward, LATENCY_RADIO, latencyEdgeArrival(EDGE_RADIO_UP));
   }
   // Releasing => stop
-  if (buttonDown.released() || buttonUp.released() ||
-      radioButtonDown.released() || radioButtonUp.released()) {
-    fsm.trigger(stop);
+  if (buttonDown.released()) {
+    timedTrigger(stop, LATENCY_BUTTON, latencyEdgeArrival(EDGE_BUTTON_DOWN));
+  } else if (buttonUp.released()) {
+    timedTrigger(stop, LATENCY_BUTTON, latencyEdgeArrival(EDGE_BUTTON_UP));
+  } else if (radioButtonDown.released()) {
+    timedTrigger(stop, LATENCY_RADIO, latencyEdgeArrival(EDGE_RADIO_DOWN));
+  } else if (radioButtonUp.released()) {
+    timedTrigger(stop, LATENCY_RADIO, latencyEdgeArrival(EDGE_RADIO_UP));
   }
+  latencyEdgeExpire(EDGE_BUTTON_DOWN, buttonDown);
+  latencyEdgeExpire(EDGE_BUTTON_UP, buttonUp);
+  latencyEdgeExpire(EDGE_RADIO_DOWN, radioButtonDown);
+  latencyEdgeExpire(EDGE_RADIO_UP, radioButtonUp);
+
+  handleRamp();
+  handleRodeCounter();
+  handleConfig();
 
   nmea2000->ParseMessages();
+  n2kDrainMicros = micros();
   SendN2k();
 }
 
@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+"""Command latency under load, stdlib only.
+
+Opens CLIENTS WebSocket clients that poll getStatus, optionally raises the
+MQTT telemetry rate and floods the CAN bus, then fires move/stop cycles over
+WebSocket (and MQTT when BROKER is set) and saves GET /latency to OUT.
+
+    DEVICE=192.168.4.10 test/latency/run.py
+    DEVICE=192.168.4.10 BROKER=192.168.4.2 CAN_IFACE=can0 test/latency/run.py
+
+DEVICE      controller address (required)
+BROKER      broker the controller is already configured for; enables MQTT
+            commands (mosquitto_pub) and a faster telemetry interval
+CAN_IFACE   SocketCAN interface on the N2K bus; enables background PGN 127501
+            traffic and PGN 127502 injection (cansend from can-utils)
+CLIENTS     WebSocket clients kept open, default 4
+CYCLES      move/stop cycles per source, default 20
+OUT         report file, default latency-<time>.json
+
+Coverage: websocket and mqtt are measured end to end. n2k is only measured
+with CAN_IFACE, and reports relay latency (CZone relay 1 is toggled), not
+motor latency. The local and radio buttons need a GPIO rig driving pins
+21/22 and 27/26; this script does not cover them and their entries stay at
+n=0.
+
+The controller must start in the OFF state. This drives the motor outputs;
+only run it on a bench.
+"""
+import json
+import os
+import socket
+import subprocess
+import sys
+import threading
+import time
+import urllib.request
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "mqtt_bridge"))
+from ws_send import connect, send_frame  # noqa: E402
+
+DEVICE = os.environ.get("DEVICE") or sys.exit("set DEVICE to the controller address")
+BROKER = os.environ.get("BROKER", "")
+CAN_IFACE = os.environ.get("CAN_IFACE", "")
+CLIENTS = int(os.environ.get("CLIENTS", "4"))
+CYCLES = int(os.environ.get("CYCLES", "20"))
+OUT = os.environ.get("OUT", time.strftime("latency-%Y%m%d-%H%M%S.json"))
+
+MOVE_TIME = 0.3       # s the motor runs per cycle
+PAUSE_TIME = 0.3      # s between cycles
+POLL_INTERVAL = 0.1   # s between getStatus requests per client
+MQTT_INTERVAL = 100   # ms telemetry interval during the run
+
+stopping = threading.Event()
+
+
+def http(path, body=None):
+    req = urllib.request.Request(f"http://{DEVICE}{path}")
+    if body is not None:
+        req.data = json.dumps(body).encode()
+        req.add_header("Content-Type", "application/json")
+    with urllib.request.urlopen(req, timeout=5) as response:
+        return json.loads(response.read())
+
+
+def drain(sock):
+    # every command makes the controller broadcast to all clients; a client
+    # that stops reading gets dropped once its send queue is full
+    try:
+        while sock.recv(4096):
+            pass
+    except socket.timeout:
+        return True
+    except OSError:
+        pass
+    return False
+
+
+def ws_client():
+    sock = connect(DEVICE)
+    sock.settimeout(POLL_INTERVAL)
+    try:
+        while not stopping.is_set():
+            send_frame(sock, "getStatus")
+            if not drain(sock):
+                raise OSError("closed by the controller")
+    except OSError as e:
+        print(f"warning: ws client stopped early: {e}", file=sys.stderr)
+    sock.close()
+
+
+def control_reader(sock):
+    while not stopping.is_set() and drain(sock):
+        pass
+
+
+def can_traffic():
+    # PGN 127501, priority 3, source 0x01: bank instance 1, all unavailable
+    while not stopping.is_set():
+        subprocess.run(["cansend", CAN_IFACE, "0DF20D01#01FFFFFFFFFFFFFF"], check=False)
+        time.sleep(0.01)
+
+
+def mqtt_send(command):
+    subprocess.run(["mosquitto_pub", "-h", BROKER, "-t", "anchorwinch/cmd", "-m", command], check=True)
+
+
+def n2k_toggle(instance):
+    # PGN 127502 switch bank control: switch 1 on, the rest unavailable.
+    # The controller toggles relay 1 on every request.
+    subprocess.run(["cansend", CAN_IFACE, f"0DF20E01#{instance:02X}FDFFFFFFFFFFFF"], check=True)
+
+
+def cycles(send, commands):
+    for i in range(CYCLES):
+        send(commands[i % len(commands)])
+        time.sleep(MOVE_TIME)
+        send("stop")
+        time.sleep(PAUSE_TIME)
+
+
+def main():
+    control = connect(DEVICE)
+    control.settimeout(1)
+    config = http("/config")
+    threads = [threading.Thread(target=ws_client, daemon=True) for _ in range(CLIENTS)]
+    threads.append(threading.Thread(target=control_reader, args=(control,), daemon=True))
+    if CAN_IFACE:
+        threads.append(threading.Thread(target=can_traffic, daemon=True))
+    if BROKER:
+        http("/config", {"mqttInterval": MQTT_INTERVAL})
+
+    try:
+        for t in threads:
+            t.start()
+        time.sleep(2)  # let the background load settle
+        http("/latency?reset=1")
+
+        send_frame(control, "switchHigh")
+        time.sleep(PAUSE_TIME)
+        cycles(lambda c: send_frame(control, c), ["down", "up"])
+        if BROKER:
+            cycles(mqtt_send, ["forward", "backward"])
+        if CAN_IFACE:
+            for _ in range(2 * CYCLES):
+                n2k_toggle(config["n2kDeviceInstance"])
+                time.sleep(PAUSE_TIME)
+        send_frame(control, "switchLow")
+        time.sleep(PAUSE_TIME)
+        report = http("/latency")
+    finally:
+        stopping.set()
+        send_frame(control, "switchLow")
+        if BROKER:
+            http("/config", {"mqttInterval": config["mqttInterval"]})
+        for t in threads:
+            t.join(timeout=2)
+        control.close()
+
+    with open(OUT, "w") as f:
+        json.dump(report, f, indent=2)
+
+    print(f"{CLIENTS} ws clients, mqtt {'on' if BROKER else 'off'}, can {'on' if CAN_IFACE else 'off'}")
+    for source, kinds in report.items():
+        if not isinstance(kinds, dict):
+            continue
+        for kind, st in kinds.items():
+            print(f"{source:10} {kind:9} n={st['n']:4} p50={st['p50']:7} p99={st['p99']:7} max={st['max']:7} us")
+    print(f"report saved to {OUT}")
+
+    # one sample per command: toggles from and to standstill don't count
+    expected = [("websocket", "move"), ("websocket", "stop")]
+    if BROKER:
+        expected += [("mqtt", "move"), ("mqtt", "stop")]
+    if CAN_IFACE:
+        expected += [("n2k", "relayOn"), ("n2k", "relayOff")]
+    failed = False
+    for source, kind in expected:
+        n = report[source][kind]["n"]
+        if n != CYCLES:
+            print(f"FAIL: {source} {kind} has {n} samples, expected {CYCLES}")
+            failed = True
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
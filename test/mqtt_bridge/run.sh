@@ -0,0 +1,111 @@
+#!/usr/bin/env bash
+# End-to-end check of the MQTT bridge against a local mosquitto broker.
+#
+# Needs mosquitto, mosquitto_pub/mosquitto_sub, curl and python3 on this
+# machine and a flashed controller on the same network, in the OFF state.
+#
+#   DEVICE=192.168.4.10 BROKER=192.168.4.2 test/mqtt_bridge/run.sh
+#
+# DEVICE is the controller, BROKER the address of this machine as seen by
+# the controller. The script points the controller at the broker via
+# POST /config, then checks telemetry, commands and the offline queue.
+#
+# RUN_MOTOR=1 adds a half-open link check: the motor is started over MQTT and
+# the broker is frozen (SIGSTOP) so the TCP connection stays up but nothing
+# answers. The controller must notice via keepalive and stop the motor. This
+# drives the motor outputs; only run it on a bench.
+set -euo pipefail
+
+DEVICE=${DEVICE:?set DEVICE to the controller address}
+BROKER=${BROKER:?set BROKER to the address of this machine}
+PORT=${PORT:-1883}
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+BROKER_PID=
+
+cleanup() {
+  [ -n "$BROKER_PID" ] && kill "$BROKER_PID" 2>/dev/null || true
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() { echo "FAIL: $*" >&2; exit 1; }
+
+start_broker() {
+  printf 'listener %s 0.0.0.0\nallow_anonymous true\n' "$PORT" > "$WORK/mosquitto.conf"
+  mosquitto -c "$WORK/mosquitto.conf" > "$WORK/mosquitto.log" 2>&1 &
+  BROKER_PID=$!
+  for _ in $(seq 50); do
+    mosquitto_sub -p "$PORT" -t '$SYS/#' -C 1 -W 1 > /dev/null 2>&1 && return
+    sleep 0.1
+  done
+  fail "mosquitto did not start"
+}
+
+stop_broker() {
+  kill "$BROKER_PID"
+  wait "$BROKER_PID" 2>/dev/null || true
+  BROKER_PID=
+}
+
+# expect <file> <pattern>: the captured telemetry must contain the pattern
+expect() {
+  grep -q -- "$2" "$1" || { cat "$1" >&2; fail "expected $2"; }
+}
+
+start_broker
+
+echo "configuring controller for broker $BROKER:$PORT"
+curl -sf -X POST -H 'Content-Type: application/json' \
+  -d "{\"mqttServer\":\"$BROKER\",\"mqttPort\":$PORT}" "http://$DEVICE/config" > /dev/null \
+  || fail "POST /config"
+
+echo "waiting for the controller to come online"
+mosquitto_sub -p "$PORT" -t anchorwinch/status -C 1 -W 30 > "$WORK/status" || fail "no status"
+expect "$WORK/status" online
+
+echo "commands: toggleOn / toggleOff"
+mosquitto_sub -p "$PORT" -t anchorwinch/telemetry -W 5 > "$WORK/cmd" &
+SUB=$!
+sleep 0.5
+mosquitto_pub -p "$PORT" -t anchorwinch/cmd -m toggleOn
+sleep 1
+mosquitto_pub -p "$PORT" -t anchorwinch/cmd -m toggleOff
+wait "$SUB" || true
+expect "$WORK/cmd" '"s":1'
+expect "$WORK/cmd" '"s":0'
+
+echo "offline queue: state changes while the broker is down"
+stop_broker
+sleep 1
+python3 "$HERE/ws_send.py" "$DEVICE" switchHigh
+sleep 1
+python3 "$HERE/ws_send.py" "$DEVICE" switchLow
+sleep 1
+start_broker
+# the controller retries every 5 s; queued payloads come first, oldest first
+mosquitto_sub -p "$PORT" -t anchorwinch/telemetry -W 15 > "$WORK/queued" || true
+expect "$WORK/queued" '"e":\[1\]'
+expect "$WORK/queued" '"e":\[0\]'
+[ "$(grep -n '"e":\[1\]' "$WORK/queued" | head -1 | cut -d: -f1)" -lt \
+  "$(grep -n '"e":\[0\]' "$WORK/queued" | head -1 | cut -d: -f1)" ] \
+  || fail "queued payloads out of order"
+
+if [ "${RUN_MOTOR:-0}" = 1 ]; then
+  echo "half-open link: motion started over MQTT stops when the broker goes silent"
+  mosquitto_pub -p "$PORT" -t anchorwinch/cmd -m toggleOn
+  sleep 1
+  mosquitto_pub -p "$PORT" -t anchorwinch/cmd -m forward
+  sleep 1
+  kill -STOP "$BROKER_PID"
+  # keepalive 5 s: dead link noticed after at most 10 s
+  sleep 15
+  kill -CONT "$BROKER_PID"
+  mosquitto_sub -p "$PORT" -t anchorwinch/telemetry -W 15 > "$WORK/halfopen" || true
+  mosquitto_pub -p "$PORT" -t anchorwinch/cmd -m toggleOff
+  # the snapshot after reconnecting must show break (1), not spinForward (2)
+  expect "$WORK/halfopen" '"s":1'
+  ! grep -q '"s":2' "$WORK/halfopen" || fail "motor still running after link loss"
+fi
+
+echo "PASS"
@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Send text commands to the winch WebSocket (/ws), stdlib only.
+
+usage: ws_send.py <device-host> <command> [<command> ...]
+"""
+import base64
+import os
+import socket
+import sys
+
+
+def send_frame(sock, text):
+    payload = text.encode()
+    mask = os.urandom(4)
+    header = bytes([0x81, 0x80 | len(payload)]) + mask
+    sock.sendall(header + bytes(b ^ mask[i % 4] for i, b in enumerate(payload)))
+
+
+def connect(host, port=80):
+    """Open /ws and return the socket after a successful upgrade."""
+    sock = socket.create_connection((host, port), timeout=5)
+    key = base64.b64encode(os.urandom(16)).decode()
+    sock.sendall((
+        "GET /ws HTTP/1.1\r\n"
+        f"Host: {host}\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        f"Sec-WebSocket-Key: {key}\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n").encode())
+    response = sock.recv(1024)
+    if b" 101 " not in response.split(b"\r\n", 1)[0]:
+        sys.exit(f"websocket handshake failed: {response!r}")
+    return sock
+
+
+def main():
+    host, commands = sys.argv[1], sys.argv[2:]
+    sock = connect(host)
+    for command in commands:
+        send_frame(sock, command)
+    sock.close()
+
+
+if __name__ == "__main__":
+    main()